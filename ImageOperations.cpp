@@ -16,6 +16,10 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/videoio.hpp>
 #include <opencv2/video.hpp>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
 using namespace cv;
 using namespace std;
 
@@ -31,6 +35,10 @@ int const gaus_blur_amount = 3;
 int const median_blur = 7;
 int const brightness_level = 40;
 int const number_random_frames = 30;
+unsigned int const background_seed = 399;
+string const background_cache_env = "HAND_DETECTION_CACHE_DIR";
+string const background_cache_magic = "HandDetectionBackground";
+int const background_cache_version = 2;
 int const background_remover_thresh = 20;
 int const red_color_thresh = 190;
 
@@ -116,33 +124,61 @@ void PrepareImage(Mat& image) {
 	ModifySaturation(image, sat_val);
 }
 
+// IsObjectColor
+// Precondition: Parameters are color values between 0 and 255
+// Postcondition: Returns true if the color is red enough to be part of the hand
+bool IsObjectColor(int const blue, int const green, int const red) {
+	return (red >= red_color_thresh) ||
+		(red < red_color_thresh && red > blue && red > green);
+}
+
+// BuildColorTable
+// Precondition: None
+// Postcondition: Returns a 256 x 256 lookup table indexed by a pixel's red value and the
+//                larger of its blue and green values. IsObjectColor only depends on those
+//                two values, so each entry is 255 if IsObjectColor passes and 0 otherwise.
+vector<uchar> BuildColorTable() {
+	vector<uchar> table(256 * 256);
+	for (int red = 0; red < 256; red++) {
+		for (int max_blue_green = 0; max_blue_green < 256; max_blue_green++) {
+			table[(red << 8) | max_blue_green] =
+				IsObjectColor(max_blue_green, max_blue_green, red) ? 255 : 0;
+		}
+	}
+	return table;
+}
+
+// ColorTable
+// Precondition: None
+// Postcondition: Returns the color lookup table, building it the first time it is used
+const vector<uchar>& ColorTable() {
+	static const vector<uchar> color_table = BuildColorTable();
+	return color_table;
+}
+
 // BackgroundRemover
 // Precondition: Parameters are properly formatted, passed in correctly and colored
 // Postcondition: Will return a binary Matt where the white spots are the differences
 //                between the 2 passed in Mats.
 Mat BackgroundRemover(const Mat& front, const Mat& back) {
 	Mat output(back.rows, back.cols, CV_8U);
+	uchar const* table = ColorTable().data();
 	for (int row = 0; row < back.rows; row++) {
+		const Vec3b* front_row = front.ptr<Vec3b>(row);
+		const Vec3b* back_row = back.ptr<Vec3b>(row);
+		uchar* output_row = output.ptr<uchar>(row);
 		for (int col = 0; col < back.cols; col++) {
-			int front_color_b = front.at<Vec3b>(row, col)[0];
-			int front_color_g = front.at<Vec3b>(row, col)[1];
-			int front_color_r = front.at<Vec3b>(row, col)[2];
-			int back_color_b = back.at<Vec3b>(row, col)[0];
-			int back_color_g = back.at<Vec3b>(row, col)[1];
-			int back_color_r = back.at<Vec3b>(row, col)[2];
-			if (abs(front_color_b - back_color_b) < background_remover_thresh &&
-				abs(front_color_g - back_color_g) < background_remover_thresh &&
-				abs(front_color_r - back_color_r) < background_remover_thresh) { // Very similar
-				output.at<uchar>(row, col) = 0;
+			int const front_color_b = front_row[col][0];
+			int const front_color_g = front_row[col][1];
+			int const front_color_r = front_row[col][2];
+			bool const similar = (abs(front_color_b - back_row[col][0]) < background_remover_thresh) &
+				(abs(front_color_g - back_row[col][1]) < background_remover_thresh) &
+				(abs(front_color_r - back_row[col][2]) < background_remover_thresh);
+			if (similar) {	// Very similar
+				output_row[col] = 0;
 			}
-			else {	// Not similar. Object here
-				if ((front_color_r >= red_color_thresh) ||
-					(front_color_r < red_color_thresh &&
-						front_color_r > front_color_b &&
-						front_color_r > front_color_g)) {
-					output.at<uchar>(row, col) = 255;
-				}
-				else output.at<uchar>(row, col) = 0;;
+			else {	// Not similar. The color table decides if it is the object
+				output_row[col] = table[(front_color_r << 8) | max(front_color_b, front_color_g)];
 			}
 		}
 	}
@@ -151,19 +187,27 @@ Mat BackgroundRemover(const Mat& front, const Mat& back) {
 
 // ExtractBackground
 // Preconditions: video is correctly formatted and allocated
-// Postconditions: the calculated background from the video is returned as a Mat
+// Postconditions: the calculated background from the video is returned as a Mat. An empty
+//                Mat is returned if the video has fewer than number_random_frames frames.
 Mat ExtractBackground(VideoCapture& video) {
 	const int frame_width = (int)video.get(CAP_PROP_FRAME_WIDTH);
 	const int frame_height = (int)video.get(CAP_PROP_FRAME_HEIGHT);
 	const int number_of_frames = (int)video.get(CAP_PROP_FRAME_COUNT);
 	vector<int> random_frames;
+	mt19937 generator(background_seed);
+
+	// Not enough frames to pick from, or the backend could not report the frame count
+	if (number_of_frames < number_random_frames) {
+		return Mat();
+	}
 
-	// Determine which random frames to use for background calculation
+	// Determine which random frames to use for background calculation. Seeded so the
+	// same video always gives the same background as the one saved in the cache
 	for (int i = 0; i < number_random_frames; i++) {
-		int random_frame = rand() % number_of_frames;
+		int random_frame = (int)(generator() % (unsigned int)number_of_frames);
 		while (find(random_frames.begin(), random_frames.end(), random_frame) !=
 			   random_frames.end()) {
-			random_frame = rand() % number_of_frames;
+			random_frame = (int)(generator() % (unsigned int)number_of_frames);
 		}
 		random_frames.push_back(random_frame);
 	}
@@ -219,4 +263,218 @@ Mat ExtractBackground(VideoCapture& video) {
 	}
 	video.set(CAP_PROP_POS_MSEC, 0);
 	return extracted_background;
-}
\ No newline at end of file
+}
+
+// BackgroundCacheKey
+// Precondition: video is correctly formatted and allocated and was opened from video_path
+// Postcondition: Returns a string that identifies the source video and every setting
+//                used to compute its prepared background
+string BackgroundCacheKey(const string& video_path, VideoCapture& video) {
+	error_code error;
+	filesystem::path source = filesystem::weakly_canonical(video_path, error);
+	if (error) source = video_path;
+	uintmax_t file_size = filesystem::file_size(source, error);
+	if (error) file_size = 0;
+	long long modified = 0;
+	filesystem::file_time_type write_time = filesystem::last_write_time(source, error);
+	if (!error) modified = (long long)write_time.time_since_epoch().count();
+
+	stringstream key;
+	key << background_cache_version << "|" << source.string() << "|" << file_size << "|" << modified << "|"
+		<< (int)video.get(CAP_PROP_FRAME_WIDTH) << "x" << (int)video.get(CAP_PROP_FRAME_HEIGHT) << "|"
+		<< (int)video.get(CAP_PROP_FRAME_COUNT) << "|" << number_random_frames << "|"
+		<< background_seed << "|" << median_blur << "|" << contrast_num << "|"
+		<< gaus_blur_size << "|" << gaus_blur_amount << "|" << brightness_level << "|" << sat_val;
+	return key.str();
+}
+
+// GetEnvironmentPath
+// Precondition: name is passed in correctly
+// Postcondition: Returns the value of the environment variable name, or an empty path
+//                if it is not set or is empty
+filesystem::path GetEnvironmentPath(const char* name) {
+	const char* value = getenv(name);
+	if (value == nullptr || value[0] == '\0') {
+		return filesystem::path();
+	}
+	return filesystem::path(value);
+}
+
+// BackgroundCacheDir
+// Precondition: None
+// Postcondition: Returns the folder backgrounds are cached in. This is the folder in the
+//                HAND_DETECTION_CACHE_DIR environment variable if it is set, otherwise a
+//                HandDetection folder in the user's cache folder (LOCALAPPDATA on Windows,
+//                XDG_CACHE_HOME or ~/.cache elsewhere), so the cache is shared by every
+//                process no matter where it was started from and survives reboots.
+filesystem::path BackgroundCacheDir() {
+	filesystem::path folder = GetEnvironmentPath(background_cache_env.c_str());
+	if (!folder.empty()) {
+		return folder;
+	}
+	folder = GetEnvironmentPath("LOCALAPPDATA");
+	if (folder.empty()) folder = GetEnvironmentPath("XDG_CACHE_HOME");
+	if (folder.empty()) {
+		filesystem::path home = GetEnvironmentPath("HOME");
+		if (!home.empty()) folder = home / ".cache";
+	}
+	if (folder.empty()) {
+		error_code error;
+		folder = filesystem::temp_directory_path(error);
+		if (error) folder = filesystem::current_path(error);
+	}
+	return folder / "HandDetection" / "background_cache";
+}
+
+// BackgroundCachePath
+// Precondition: key is a key returned by BackgroundCacheKey
+// Postcondition: Returns the file the background for key is stored in, named by a
+//                FNV-1a hash of key
+string BackgroundCachePath(const string& key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	stringstream name;
+	name << hex << hash << ".bgcache";
+	return (BackgroundCacheDir() / name.str()).string();
+}
+
+// WarnBackgroundCache
+// Precondition: message is passed in correctly
+// Postcondition: Prints message to stderr the first time the cache can not be written.
+//                Later messages are ignored so a read only cache does not flood the output.
+void WarnBackgroundCache(const string& message) {
+	static bool warned = false;
+	if (!warned) {
+		cerr << "Background cache not saved: " << message << endl;
+		warned = true;
+	}
+}
+
+// ReadCachedBackground
+// Precondition: Parameters are passed in correctly
+// Postcondition: Returns the background stored in the cache file at path. An empty Mat is
+//                returned if the file is missing, truncated, corrupt, from another cache
+//                version or key, or is not a colored image of the given size.
+//                The file is a 3 line header (magic and version, key, PNG size) followed
+//                by the background encoded as a PNG.
+Mat ReadCachedBackground(const string& path, const string& key, int const width,
+	                     int const height) {
+	ifstream input(path, ios::binary);
+	if (!input) {
+		return Mat();
+	}
+	string version_line;
+	string cached_key;
+	string size_line;
+	getline(input, version_line);
+	getline(input, cached_key);
+	getline(input, size_line);
+	if (!input || version_line != background_cache_magic + " " + to_string(background_cache_version) ||
+		cached_key != key) {
+		return Mat();
+	}
+
+	// The PNG must fill the rest of the file exactly, otherwise it was cut short
+	error_code error;
+	uintmax_t const file_size = filesystem::file_size(path, error);
+	uintmax_t const header_size = (uintmax_t)input.tellg();
+	if (error || size_line != to_string(file_size - header_size)) {
+		return Mat();
+	}
+	vector<uchar> png((size_t)(file_size - header_size));
+	input.read((char*)png.data(), png.size());
+	if (!input) {
+		return Mat();
+	}
+
+	Mat background;
+	try {
+		background = imdecode(png, IMREAD_COLOR);
+	}
+	catch (const cv::Exception&) {
+		return Mat();
+	}
+	if (background.type() != CV_8UC3 || background.cols != width || background.rows != height) {
+		return Mat();
+	}
+	return background;
+}
+
+// WriteCachedBackground
+// Precondition: Parameters are passed in correctly
+// Postcondition: background is saved to the cache file at path in the format read by
+//                ReadCachedBackground. It is written to a temporary file first and only
+//                moved to path once it has the expected size, so other processes never see
+//                a partial cache file. A warning is printed if it could not be saved.
+void WriteCachedBackground(const string& path, const string& key, const Mat& background) {
+	error_code error;
+	const filesystem::path folder = filesystem::path(path).parent_path();
+	filesystem::create_directories(folder, error);
+	if (error) {
+		WarnBackgroundCache("could not create " + folder.string() + " (" + error.message() + ")");
+		return;
+	}
+
+	vector<uchar> png;
+	try {
+		if (!imencode(".png", background, png)) png.clear();
+	}
+	catch (const cv::Exception&) {
+		png.clear();
+	}
+	if (png.empty()) {
+		WarnBackgroundCache("could not encode the background");
+		return;
+	}
+
+	const string header = background_cache_magic + " " + to_string(background_cache_version) + "\n" +
+		key + "\n" + to_string(png.size()) + "\n";
+	const string temp_path = path + "." + to_string(random_device()()) + ".tmp";
+	ofstream output(temp_path, ios::binary);
+	output.write(header.data(), header.size());
+	output.write((const char*)png.data(), png.size());
+	output.close();
+
+	bool written = !output.fail();
+	if (written) {
+		uintmax_t const size = filesystem::file_size(temp_path, error);
+		written = !error && size == header.size() + png.size();
+	}
+	if (written) {
+		filesystem::rename(temp_path, path, error);
+		written = !error;
+	}
+	if (!written) {
+		filesystem::remove(temp_path, error);
+		WarnBackgroundCache("could not write " + path);
+	}
+}
+
+// LoadBackground
+// Precondition: video is correctly formatted and allocated and was opened from video_path
+// Postcondition: Returns the prepared background of the video. It is read from the
+//                background cache if it was saved before, otherwise it is computed with
+//                ExtractBackground and PrepareImage and saved to the cache for next time.
+//                An empty Mat is returned if the background could not be computed.
+Mat LoadBackground(const string& video_path, VideoCapture& video) {
+	const int frame_width = (int)video.get(CAP_PROP_FRAME_WIDTH);
+	const int frame_height = (int)video.get(CAP_PROP_FRAME_HEIGHT);
+	const string key = BackgroundCacheKey(video_path, video);
+	const string cache_path = BackgroundCachePath(key);
+
+	Mat background = ReadCachedBackground(cache_path, key, frame_width, frame_height);
+	if (!background.empty()) {
+		return background;
+	}
+
+	background = ExtractBackground(video);
+	if (background.empty()) {
+		return background;
+	}
+	PrepareImage(background);
+	WriteCachedBackground(cache_path, key, background);
+	return background;
+}
@@ -27,7 +27,7 @@ string const video_name_path = "/assets/hand.mp4";
 int const skip_frames = 3;
 Scalar const box_color = Scalar{ 0, 0, 255 };
 
-Mat ExtractBackground(VideoCapture& video);
+Mat LoadBackground(const string& video_path, VideoCapture& video);
 void PrepareImage(Mat& image);
 Mat BackgroundRemover(const Mat& front, const Mat& back);
 vector<vector<Point>> FindImageContours(const Mat& object);
@@ -51,8 +51,8 @@ int main(int argc, char argv[]) {
 	int const frame_width = (int)cap.get(CAP_PROP_FRAME_WIDTH);
 	int const frame_height = (int)cap.get(CAP_PROP_FRAME_HEIGHT);
 
-	Mat background = ExtractBackground(cap);
-	PrepareImage(background);
+	Mat background = LoadBackground(video_name_path, cap);
+	if (background.empty()) return -1;
 
 	Mat frame;
 	Hand current_hand;